@@ -0,0 +1,1226 @@
+#include "MJPEG.h"
+
+#include <Array.h>
+#include <ArrayDef.h>
+#include <Types.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MJPEG_USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define MJPEG_USE_SSE2 0
+#endif
+
+namespace mjpeg {
+
+// Four floats, processed in parallel with SSE2 if available.
+// The DCT and color conversion are written in terms of this,
+// so that the scalar fallback is the same code.
+struct Vec4 {
+#if MJPEG_USE_SSE2
+    __m128 v;
+
+    static Vec4 load(const float* p) noexcept {
+        return Vec4{_mm_loadu_ps(p)};
+    }
+    static Vec4 broadcast(float f) noexcept {
+        return Vec4{_mm_set1_ps(f)};
+    }
+    void store(float* p) const noexcept {
+        _mm_storeu_ps(p, v);
+    }
+    friend Vec4 operator+(Vec4 a, Vec4 b) noexcept {
+        return Vec4{_mm_add_ps(a.v, b.v)};
+    }
+    friend Vec4 operator-(Vec4 a, Vec4 b) noexcept {
+        return Vec4{_mm_sub_ps(a.v, b.v)};
+    }
+    friend Vec4 operator*(Vec4 a, Vec4 b) noexcept {
+        return Vec4{_mm_mul_ps(a.v, b.v)};
+    }
+
+    // Splits 4 RGB32 pixels into red, green, and blue components.
+    static void loadPixels(const uint32* p, Vec4& r, Vec4& g, Vec4& b) noexcept {
+        const __m128i pixels = _mm_loadu_si128((const __m128i*)p);
+        const __m128i mask = _mm_set1_epi32(0xFF);
+        b.v = _mm_cvtepi32_ps(_mm_and_si128(pixels, mask));
+        g.v = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 8), mask));
+        r.v = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(pixels, 16), mask));
+    }
+
+    // Returns {a0+a1, a2+a3, b0+b1, b2+b3}
+    static Vec4 pairSums(Vec4 a, Vec4 b) noexcept {
+        const __m128 evens = _mm_shuffle_ps(a.v, b.v, _MM_SHUFFLE(2,0,2,0));
+        const __m128 odds = _mm_shuffle_ps(a.v, b.v, _MM_SHUFFLE(3,1,3,1));
+        return Vec4{_mm_add_ps(evens, odds)};
+    }
+
+    static void transpose(Vec4& a, Vec4& b, Vec4& c, Vec4& d) noexcept {
+        _MM_TRANSPOSE4_PS(a.v, b.v, c.v, d.v);
+    }
+
+    // Rounds to the nearest integer.
+    void storeRounded(int* p) const noexcept {
+        _mm_storeu_si128((__m128i*)p, _mm_cvtps_epi32(v));
+    }
+#else
+    float v[4];
+
+    static Vec4 load(const float* p) noexcept {
+        return Vec4{{p[0], p[1], p[2], p[3]}};
+    }
+    static Vec4 broadcast(float f) noexcept {
+        return Vec4{{f, f, f, f}};
+    }
+    void store(float* p) const noexcept {
+        for (size_t i = 0; i < 4; ++i) {
+            p[i] = v[i];
+        }
+    }
+    friend Vec4 operator+(Vec4 a, Vec4 b) noexcept {
+        return Vec4{{a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2], a.v[3]+b.v[3]}};
+    }
+    friend Vec4 operator-(Vec4 a, Vec4 b) noexcept {
+        return Vec4{{a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2], a.v[3]-b.v[3]}};
+    }
+    friend Vec4 operator*(Vec4 a, Vec4 b) noexcept {
+        return Vec4{{a.v[0]*b.v[0], a.v[1]*b.v[1], a.v[2]*b.v[2], a.v[3]*b.v[3]}};
+    }
+
+    static void loadPixels(const uint32* p, Vec4& r, Vec4& g, Vec4& b) noexcept {
+        for (size_t i = 0; i < 4; ++i) {
+            b.v[i] = float(p[i] & 0xFF);
+            g.v[i] = float((p[i] >> 8) & 0xFF);
+            r.v[i] = float((p[i] >> 16) & 0xFF);
+        }
+    }
+
+    static Vec4 pairSums(Vec4 a, Vec4 b) noexcept {
+        return Vec4{{a.v[0]+a.v[1], a.v[2]+a.v[3], b.v[0]+b.v[1], b.v[2]+b.v[3]}};
+    }
+
+    static void transpose(Vec4& a, Vec4& b, Vec4& c, Vec4& d) noexcept {
+        std::swap(a.v[1], b.v[0]);
+        std::swap(a.v[2], c.v[0]);
+        std::swap(a.v[3], d.v[0]);
+        std::swap(b.v[2], c.v[1]);
+        std::swap(b.v[3], d.v[1]);
+        std::swap(c.v[3], d.v[2]);
+    }
+
+    void storeRounded(int* p) const noexcept {
+        for (size_t i = 0; i < 4; ++i) {
+            p[i] = int(v[i] + ((v[i] >= 0) ? 0.5f : -0.5f));
+        }
+    }
+#endif
+};
+
+// Maps zigzag order to natural (row-major) order within an 8x8 block.
+static const uint8 zigzagToNatural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Example quantization tables from the JPEG specification, Annex K, in natural order.
+static const uint8 baseLuminanceQuantTable[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+static const uint8 baseChrominanceQuantTable[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+// Example Huffman tables from the JPEG specification, Annex K.
+// The first array of each pair is the number of codes of each length from 1 to 16.
+static const uint8 luminanceDCBits[16] = {0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const uint8 luminanceDCValues[12] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const uint8 chrominanceDCBits[16] = {0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const uint8 chrominanceDCValues[12] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const uint8 luminanceACBits[16] = {0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7D};
+static const uint8 luminanceACValues[162] = {
+    0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+    0x22,0x71,0x14,0x32,0x81,0x91,0xA1,0x08,0x23,0x42,0xB1,0xC1,0x15,0x52,0xD1,0xF0,
+    0x24,0x33,0x62,0x72,0x82,0x09,0x0A,0x16,0x17,0x18,0x19,0x1A,0x25,0x26,0x27,0x28,
+    0x29,0x2A,0x34,0x35,0x36,0x37,0x38,0x39,0x3A,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+    0x4A,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+    0x6A,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+    0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,0xA5,0xA6,0xA7,
+    0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,0xC3,0xC4,0xC5,
+    0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,0xE1,0xE2,
+    0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF1,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,0xF8,
+    0xF9,0xFA
+};
+static const uint8 chrominanceACBits[16] = {0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const uint8 chrominanceACValues[162] = {
+    0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+    0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xA1,0xB1,0xC1,0x09,0x23,0x33,0x52,0xF0,
+    0x15,0x62,0x72,0xD1,0x0A,0x16,0x24,0x34,0xE1,0x25,0xF1,0x17,0x18,0x19,0x1A,0x26,
+    0x27,0x28,0x29,0x2A,0x35,0x36,0x37,0x38,0x39,0x3A,0x43,0x44,0x45,0x46,0x47,0x48,
+    0x49,0x4A,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x63,0x64,0x65,0x66,0x67,0x68,
+    0x69,0x6A,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8A,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0xA2,0xA3,0xA4,0xA5,
+    0xA6,0xA7,0xA8,0xA9,0xAA,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xC2,0xC3,
+    0xC4,0xC5,0xC6,0xC7,0xC8,0xC9,0xCA,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,
+    0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,0xF8,
+    0xF9,0xFA
+};
+
+struct HuffmanTable {
+    uint16 codes[256];
+    uint8 sizes[256];
+
+    void init(const uint8* bits, const uint8* values) noexcept {
+        memset(sizes, 0, sizeof(sizes));
+        uint32 code = 0;
+        size_t valuei = 0;
+        for (uint32 length = 1; length <= 16; ++length) {
+            for (uint32 i = 0; i < bits[length-1]; ++i) {
+                const uint8 value = values[valuei];
+                codes[value] = uint16(code);
+                sizes[value] = uint8(length);
+                ++code;
+                ++valuei;
+            }
+            code <<= 1;
+        }
+    }
+};
+
+// Accumulates bits most-significant first, inserting a zero byte after
+// any 0xFF byte, as required in JPEG entropy-coded data.
+struct BitWriter {
+    Array<uint8>& output;
+    uint32 bitBuffer = 0;
+    uint32 bitCount = 0;
+
+    explicit BitWriter(Array<uint8>& output_) noexcept : output(output_) {}
+
+    void write(uint32 bits, uint32 numBits) {
+        assert(numBits <= 16);
+        bitBuffer = (bitBuffer << numBits) | bits;
+        bitCount += numBits;
+        while (bitCount >= 8) {
+            bitCount -= 8;
+            const uint8 byte = uint8(bitBuffer >> bitCount);
+            output.append(byte);
+            if (byte == 0xFF) {
+                output.append(0);
+            }
+        }
+    }
+
+    // Pads the last byte with 1 bits.
+    void flush() {
+        if (bitCount != 0) {
+            const uint32 numBits = 8 - bitCount;
+            write((1u << numBits) - 1, numBits);
+        }
+    }
+};
+
+static void appendUint16BE(Array<uint8>& output, uint32 value) {
+    output.append(uint8(value >> 8));
+    output.append(uint8(value));
+}
+
+static void appendUint16LE(Array<uint8>& output, uint32 value) {
+    output.append(uint8(value));
+    output.append(uint8(value >> 8));
+}
+
+static void appendUint32LE(Array<uint8>& output, uint32 value) {
+    output.append(uint8(value));
+    output.append(uint8(value >> 8));
+    output.append(uint8(value >> 16));
+    output.append(uint8(value >> 24));
+}
+
+static void appendFourCC(Array<uint8>& output, const char* fourCC) {
+    for (size_t i = 0; i < 4; ++i) {
+        output.append(uint8(fourCC[i]));
+    }
+}
+
+// One-dimensional forward DCT on 8 vectors of 4 values each,
+// i.e. on 4 columns of 8 values in parallel.
+// This is the floating-point AAN (Arai, Agui, Nakajima) algorithm, as in
+// the Independent JPEG Group's jfdctflt.c.  Output coefficient k is
+// scaled by aanScaleFactors[k]*sqrt(8), which is undone during quantization.
+static void forwardDCT1D(Vec4* d) noexcept {
+    const Vec4 tmp0 = d[0] + d[7];
+    const Vec4 tmp7 = d[0] - d[7];
+    const Vec4 tmp1 = d[1] + d[6];
+    const Vec4 tmp6 = d[1] - d[6];
+    const Vec4 tmp2 = d[2] + d[5];
+    const Vec4 tmp5 = d[2] - d[5];
+    const Vec4 tmp3 = d[3] + d[4];
+    const Vec4 tmp4 = d[3] - d[4];
+
+    // Even part
+    const Vec4 tmp10 = tmp0 + tmp3;
+    const Vec4 tmp13 = tmp0 - tmp3;
+    const Vec4 tmp11 = tmp1 + tmp2;
+    const Vec4 tmp12 = tmp1 - tmp2;
+
+    d[0] = tmp10 + tmp11;
+    d[4] = tmp10 - tmp11;
+
+    const Vec4 z1 = (tmp12 + tmp13) * Vec4::broadcast(0.707106781f);
+    d[2] = tmp13 + z1;
+    d[6] = tmp13 - z1;
+
+    // Odd part
+    const Vec4 oddTmp10 = tmp4 + tmp5;
+    const Vec4 oddTmp11 = tmp5 + tmp6;
+    const Vec4 oddTmp12 = tmp6 + tmp7;
+
+    const Vec4 z5 = (oddTmp10 - oddTmp12) * Vec4::broadcast(0.382683433f);
+    const Vec4 z2 = oddTmp10 * Vec4::broadcast(0.541196100f) + z5;
+    const Vec4 z4 = oddTmp12 * Vec4::broadcast(1.306562965f) + z5;
+    const Vec4 z3 = oddTmp11 * Vec4::broadcast(0.707106781f);
+
+    const Vec4 z11 = tmp7 + z3;
+    const Vec4 z13 = tmp7 - z3;
+
+    d[5] = z13 + z2;
+    d[3] = z13 - z2;
+    d[1] = z11 + z4;
+    d[7] = z11 - z4;
+}
+
+// left holds columns 0-3 of each row, and right holds columns 4-7.
+static void transpose8x8(Vec4* left, Vec4* right) noexcept {
+    Vec4::transpose(left[0], left[1], left[2], left[3]);
+    Vec4::transpose(left[4], left[5], left[6], left[7]);
+    Vec4::transpose(right[0], right[1], right[2], right[3]);
+    Vec4::transpose(right[4], right[5], right[6], right[7]);
+    for (size_t i = 0; i < 4; ++i) {
+        std::swap(left[4+i], right[i]);
+    }
+}
+
+// block is 64 level-shifted samples in natural order.
+// reciprocals are the reciprocals of the quantization divisors, in natural order.
+// output receives the quantized coefficients in natural order.
+static void forwardDCTAndQuantize(const float* block, const float* reciprocals, int* output) noexcept {
+    Vec4 left[8];
+    Vec4 right[8];
+    for (size_t row = 0; row < 8; ++row) {
+        left[row] = Vec4::load(block + 8*row);
+        right[row] = Vec4::load(block + 8*row + 4);
+    }
+
+    // Columns, then transpose, then rows, then transpose back.
+    forwardDCT1D(left);
+    forwardDCT1D(right);
+    transpose8x8(left, right);
+    forwardDCT1D(left);
+    forwardDCT1D(right);
+    transpose8x8(left, right);
+
+    for (size_t row = 0; row < 8; ++row) {
+        (left[row] * Vec4::load(reciprocals + 8*row)).storeRounded(output + 8*row);
+        (right[row] * Vec4::load(reciprocals + 8*row + 4)).storeRounded(output + 8*row + 4);
+    }
+}
+
+// Number of bits needed to represent the magnitude of value, i.e. its JPEG category.
+static uint32 bitLength(uint32 magnitude) noexcept {
+    uint32 length = 0;
+    while (magnitude != 0) {
+        ++length;
+        magnitude >>= 1;
+    }
+    return length;
+}
+
+// Writes the Huffman code for the category of value, followed by the value bits.
+static void writeCodedValue(BitWriter& writer, const HuffmanTable& table, uint32 runLength, int value) {
+    const uint32 magnitude = uint32((value < 0) ? -value : value);
+    const uint32 length = bitLength(magnitude);
+    const uint32 symbol = (runLength << 4) | length;
+    writer.write(table.codes[symbol], table.sizes[symbol]);
+    if (length != 0) {
+        // Negative values are written as value-1 in length-bit two's complement.
+        const uint32 bits = uint32((value < 0) ? (value - 1) : value) & ((1u << length) - 1);
+        writer.write(bits, length);
+    }
+}
+
+struct JPEGEncoder {
+    uint32 width;
+    uint32 height;
+
+    // Quantization divisors in zigzag order, as written in the DQT segment.
+    uint8 quantTables[2][64];
+
+    // Reciprocals of the quantization divisors, including the AAN DCT scaling, in natural order.
+    float reciprocals[2][64];
+
+    HuffmanTable dcTables[2];
+    HuffmanTable acTables[2];
+
+    // Everything before the entropy-coded data, which is the same for every frame.
+    Array<uint8> header;
+
+    void init(uint32 width_, uint32 height_, uint32 quality) {
+        width = width_;
+        height = height_;
+
+        // Same quality scaling as the Independent JPEG Group's library.
+        if (quality < 1) {
+            quality = 1;
+        }
+        else if (quality > 100) {
+            quality = 100;
+        }
+        const uint32 scale = (quality < 50) ? (5000 / quality) : (200 - 2*quality);
+
+        static const float aanScaleFactors[8] = {
+            1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+            1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+        };
+
+        const uint8* const baseTables[2] = {baseLuminanceQuantTable, baseChrominanceQuantTable};
+        for (size_t table = 0; table < 2; ++table) {
+            for (size_t i = 0; i < 64; ++i) {
+                uint32 divisor = (uint32(baseTables[table][i])*scale + 50) / 100;
+                if (divisor < 1) {
+                    divisor = 1;
+                }
+                else if (divisor > 255) {
+                    divisor = 255;
+                }
+                const size_t row = i >> 3;
+                const size_t column = i & 7;
+                reciprocals[table][i] = 1.0f / (float(divisor) * aanScaleFactors[row] * aanScaleFactors[column] * 8.0f);
+            }
+            for (size_t i = 0; i < 64; ++i) {
+                const size_t natural = zigzagToNatural[i];
+                uint32 divisor = (uint32(baseTables[table][natural])*scale + 50) / 100;
+                quantTables[table][i] = uint8((divisor < 1) ? 1 : ((divisor > 255) ? 255 : divisor));
+            }
+        }
+
+        dcTables[0].init(luminanceDCBits, luminanceDCValues);
+        dcTables[1].init(chrominanceDCBits, chrominanceDCValues);
+        acTables[0].init(luminanceACBits, luminanceACValues);
+        acTables[1].init(chrominanceACBits, chrominanceACValues);
+
+        header.setSize(0);
+
+        // SOI
+        appendUint16BE(header, 0xFFD8);
+
+        // APP0 "AVI1", as in the OpenDML description of MJPEG in AVI.
+        // The polarity byte of zero indicates that the frame is not interlaced.
+        appendUint16BE(header, 0xFFE0);
+        appendUint16BE(header, 16);
+        appendFourCC(header, "AVI1");
+        for (size_t i = 0; i < 10; ++i) {
+            header.append(0);
+        }
+
+        // DQT
+        appendUint16BE(header, 0xFFDB);
+        appendUint16BE(header, 2 + 2*65);
+        for (size_t table = 0; table < 2; ++table) {
+            header.append(uint8(table));
+            for (size_t i = 0; i < 64; ++i) {
+                header.append(quantTables[table][i]);
+            }
+        }
+
+        // SOF0: baseline, 8-bit, 3 components, with 2x2 subsampled chroma.
+        appendUint16BE(header, 0xFFC0);
+        appendUint16BE(header, 8 + 3*3);
+        header.append(8);
+        appendUint16BE(header, height);
+        appendUint16BE(header, width);
+        header.append(3);
+        header.append(1);
+        header.append(0x22);
+        header.append(0);
+        header.append(2);
+        header.append(0x11);
+        header.append(1);
+        header.append(3);
+        header.append(0x11);
+        header.append(1);
+
+        // DHT
+        // Strictly, MJPEG in AVI may omit these if they're the standard tables,
+        // but not all decoders support that, so they're always included.
+        const uint8* const huffmanBits[4] = {luminanceDCBits, luminanceACBits, chrominanceDCBits, chrominanceACBits};
+        const uint8* const huffmanValues[4] = {luminanceDCValues, luminanceACValues, chrominanceDCValues, chrominanceACValues};
+        const uint8 huffmanClassAndIDs[4] = {0x00, 0x10, 0x01, 0x11};
+        size_t dhtLength = 2;
+        for (size_t table = 0; table < 4; ++table) {
+            dhtLength += 1 + 16;
+            for (size_t i = 0; i < 16; ++i) {
+                dhtLength += huffmanBits[table][i];
+            }
+        }
+        appendUint16BE(header, 0xFFC4);
+        appendUint16BE(header, uint32(dhtLength));
+        for (size_t table = 0; table < 4; ++table) {
+            header.append(huffmanClassAndIDs[table]);
+            size_t numValues = 0;
+            for (size_t i = 0; i < 16; ++i) {
+                header.append(huffmanBits[table][i]);
+                numValues += huffmanBits[table][i];
+            }
+            for (size_t i = 0; i < numValues; ++i) {
+                header.append(huffmanValues[table][i]);
+            }
+        }
+
+        // SOS
+        appendUint16BE(header, 0xFFDA);
+        appendUint16BE(header, 6 + 2*3);
+        header.append(3);
+        header.append(1);
+        header.append(0x00);
+        header.append(2);
+        header.append(0x11);
+        header.append(3);
+        header.append(0x11);
+        header.append(0);
+        header.append(63);
+        header.append(0);
+    }
+
+    // Converts one 16x16 macroblock starting at (x0, y0) in JPEG (top-down) coordinates
+    // into 4 level-shifted luma blocks and 2 subsampled, level-shifted chroma blocks.
+    // Pixels outside the image are replaced by the nearest edge pixel.
+    void convertMacroblock(const uint32* pixels, uint32 x0, uint32 y0, float (*yBlocks)[64], float* cbBlock, float* crBlock) const noexcept {
+        float reds[16][16];
+        float greens[16][16];
+        float blues[16][16];
+
+        const Vec4 yFromR = Vec4::broadcast(0.299f);
+        const Vec4 yFromG = Vec4::broadcast(0.587f);
+        const Vec4 yFromB = Vec4::broadcast(0.114f);
+        const Vec4 levelShift = Vec4::broadcast(128.0f);
+
+        for (uint32 dy = 0; dy < 16; ++dy) {
+            const uint32 y = (y0 + dy < height) ? (y0 + dy) : (height - 1);
+            // Input rows are bottom-up.
+            const uint32* const row = pixels + size_t(height - 1 - y)*width;
+            const uint32* source = row + x0;
+            uint32 edgePixels[16];
+            if (x0 + 16 > width) {
+                for (uint32 dx = 0; dx < 16; ++dx) {
+                    edgePixels[dx] = row[(x0 + dx < width) ? (x0 + dx) : (width - 1)];
+                }
+                source = edgePixels;
+            }
+
+            float* const yRow = yBlocks[(dy >> 3)*2] + (dy & 7)*8;
+            for (uint32 dx = 0; dx < 16; dx += 4) {
+                Vec4 r;
+                Vec4 g;
+                Vec4 b;
+                Vec4::loadPixels(source + dx, r, g, b);
+                r.store(reds[dy] + dx);
+                g.store(greens[dy] + dx);
+                b.store(blues[dy] + dx);
+                const Vec4 luma = r*yFromR + g*yFromG + b*yFromB - levelShift;
+                // Columns 8-15 are in the next block over.
+                luma.store(yRow + ((dx >> 3)*64) + (dx & 7));
+            }
+        }
+
+        // Average each 2x2 group of pixels, and convert to Cb and Cr.
+        // The +128 offset of Cb and Cr cancels with the level shift.
+        const Vec4 quarter = Vec4::broadcast(0.25f);
+        const Vec4 cbFromR = Vec4::broadcast(-0.168736f);
+        const Vec4 cbFromG = Vec4::broadcast(-0.331264f);
+        const Vec4 cbFromB = Vec4::broadcast(0.5f);
+        const Vec4 crFromR = Vec4::broadcast(0.5f);
+        const Vec4 crFromG = Vec4::broadcast(-0.418688f);
+        const Vec4 crFromB = Vec4::broadcast(-0.081312f);
+        for (uint32 cy = 0; cy < 8; ++cy) {
+            for (uint32 cx = 0; cx < 8; cx += 4) {
+                const uint32 x = 2*cx;
+                const float* const r0 = reds[2*cy] + x;
+                const float* const r1 = reds[2*cy+1] + x;
+                const float* const g0 = greens[2*cy] + x;
+                const float* const g1 = greens[2*cy+1] + x;
+                const float* const b0 = blues[2*cy] + x;
+                const float* const b1 = blues[2*cy+1] + x;
+                const Vec4 r = Vec4::pairSums(Vec4::load(r0) + Vec4::load(r1), Vec4::load(r0+4) + Vec4::load(r1+4)) * quarter;
+                const Vec4 g = Vec4::pairSums(Vec4::load(g0) + Vec4::load(g1), Vec4::load(g0+4) + Vec4::load(g1+4)) * quarter;
+                const Vec4 b = Vec4::pairSums(Vec4::load(b0) + Vec4::load(b1), Vec4::load(b0+4) + Vec4::load(b1+4)) * quarter;
+                (r*cbFromR + g*cbFromG + b*cbFromB).store(cbBlock + cy*8 + cx);
+                (r*crFromR + g*crFromG + b*crFromB).store(crBlock + cy*8 + cx);
+            }
+        }
+    }
+
+    // Returns the quantized DC coefficient, for the next block's DC prediction.
+    int encodeBlock(BitWriter& writer, const float* block, size_t table, int previousDC) const {
+        int coefficients[64];
+        forwardDCTAndQuantize(block, reciprocals[table], coefficients);
+
+        // Keep values within the range supported by the baseline Huffman tables.
+        int dc = coefficients[0];
+        dc = (dc < -1024) ? -1024 : ((dc > 1023) ? 1023 : dc);
+        writeCodedValue(writer, dcTables[table], 0, dc - previousDC);
+
+        const HuffmanTable& acTable = acTables[table];
+        uint32 runLength = 0;
+        for (size_t i = 1; i < 64; ++i) {
+            int value = coefficients[zigzagToNatural[i]];
+            if (value == 0) {
+                ++runLength;
+                continue;
+            }
+            value = (value < -1023) ? -1023 : ((value > 1023) ? 1023 : value);
+            while (runLength >= 16) {
+                // ZRL: 16 zeros
+                writer.write(acTable.codes[0xF0], acTable.sizes[0xF0]);
+                runLength -= 16;
+            }
+            writeCodedValue(writer, acTable, runLength, value);
+            runLength = 0;
+        }
+        if (runLength != 0) {
+            // EOB
+            writer.write(acTable.codes[0x00], acTable.sizes[0x00]);
+        }
+        return dc;
+    }
+
+    void encodeFrame(const uint32* pixels, Array<uint8>& output) const {
+        output.setSize(0);
+        for (size_t i = 0, n = header.size(); i < n; ++i) {
+            output.append(header[i]);
+        }
+
+        BitWriter writer(output);
+        float yBlocks[4][64];
+        float cbBlock[64];
+        float crBlock[64];
+        int previousY = 0;
+        int previousCb = 0;
+        int previousCr = 0;
+        for (uint32 y0 = 0; y0 < height; y0 += 16) {
+            for (uint32 x0 = 0; x0 < width; x0 += 16) {
+                convertMacroblock(pixels, x0, y0, yBlocks, cbBlock, crBlock);
+                for (size_t block = 0; block < 4; ++block) {
+                    previousY = encodeBlock(writer, yBlocks[block], 0, previousY);
+                }
+                previousCb = encodeBlock(writer, cbBlock, 1, previousCb);
+                previousCr = encodeBlock(writer, crBlock, 1, previousCr);
+            }
+        }
+        writer.flush();
+
+        // EOI
+        appendUint16BE(output, 0xFFD9);
+    }
+};
+
+uint32 qualityFromBitRate(
+    uint32 bitsPerSecond,
+    uint32 width,
+    uint32 height,
+    uint32 fpsNumerator,
+    uint32 fpsDenominator
+) {
+    // Approximate bits per pixel of 4:2:0 baseline JPEG at each quality,
+    // for typical photographic content.
+    static const struct {
+        float bitsPerPixel;
+        float quality;
+    } curve[] = {
+        {0.25f, 10}, {0.45f, 25}, {0.7f, 50}, {1.0f, 75},
+        {1.4f, 85}, {1.8f, 90}, {2.7f, 95}, {6.0f, 100}
+    };
+    constexpr size_t curveSize = sizeof(curve)/sizeof(curve[0]);
+
+    const double pixelsPerSecond = double(width)*double(height)*double(fpsNumerator)/double(fpsDenominator);
+    if (pixelsPerSecond <= 0) {
+        return 1;
+    }
+    const float bitsPerPixel = float(double(bitsPerSecond)/pixelsPerSecond);
+    if (bitsPerPixel <= curve[0].bitsPerPixel) {
+        const float quality = curve[0].quality * bitsPerPixel / curve[0].bitsPerPixel;
+        return (quality < 1) ? 1 : uint32(quality);
+    }
+    for (size_t i = 1; i < curveSize; ++i) {
+        if (bitsPerPixel <= curve[i].bitsPerPixel) {
+            const float t = (bitsPerPixel - curve[i-1].bitsPerPixel) / (curve[i].bitsPerPixel - curve[i-1].bitsPerPixel);
+            return uint32(curve[i-1].quality + t*(curve[i].quality - curve[i-1].quality) + 0.5f);
+        }
+    }
+    return 100;
+}
+
+// Upper limit on the memory used by buffered input frames, regardless of the number of threads.
+constexpr static uint64 maxBufferedPixelBytes = uint64(1) << 30;
+
+// Many AVI 1.0 readers use signed 32-bit offsets, and OpenDML readers
+// expect segments no larger than this, so a new RIFF segment is started
+// before any segment would exceed 1GB.
+constexpr static uint64 maxSegmentSize = uint64(1) << 30;
+
+// Space is reserved in the header for this many super index entries,
+// i.e. RIFF segments, so the file size is limited to about 256GB.
+constexpr static size_t maxSuperIndexEntries = 256;
+
+// Sizes of the header lists, excluding their 8-byte list headers.
+constexpr static size_t strlListSize = 4 + (8+56) + (8+40) + (8 + 24 + 16*maxSuperIndexEntries);
+constexpr static size_t odmlListSize = 4 + (8+248);
+constexpr static size_t hdrlListSize = 4 + (8+56) + (8+strlListSize) + (8+odmlListSize);
+
+// Size of everything before the first chunk in the first "movi" list.
+constexpr static size_t aviHeaderSize = 12 + (8+hdrlListSize) + 12;
+
+// Offset of the "movi" FourCC, which idx1 chunk offsets are relative to.
+constexpr static size_t moviFourCCOffset = aviHeaderSize - 4;
+
+// Size of the "RIFF AVIX" and "LIST movi" headers at the start of each additional segment.
+constexpr static size_t extraSegmentHeaderSize = 12 + 12;
+
+// Sizes of an "ix00" chunk header and of each of its entries.
+constexpr static size_t standardIndexHeaderSize = 8 + 24;
+constexpr static size_t standardIndexEntrySize = 8;
+constexpr static size_t legacyIndexEntrySize = 16;
+
+AVIWriter::AVIWriter() = default;
+
+AVIWriter::~AVIWriter() {
+    close();
+}
+
+bool AVIWriter::open(
+    const char* filename,
+    uint32 width_,
+    uint32 height_,
+    uint32 fpsNumerator_,
+    uint32 fpsDenominator_,
+    uint32 quality,
+    size_t numThreads
+) {
+    close();
+
+    // JPEG stores the width and height as 16-bit integers.
+    if (width_ == 0 || height_ == 0 || width_ > 0xFFFF || height_ > 0xFFFF) {
+        printf("ERROR: MJPEG does not support %ux%u resolution.\n", width_, height_);
+        fflush(stdout);
+        return false;
+    }
+    if (fpsNumerator_ == 0 || fpsDenominator_ == 0) {
+        return false;
+    }
+
+    width = width_;
+    height = height_;
+    fpsNumerator = fpsNumerator_;
+    fpsDenominator = fpsDenominator_;
+    failed = false;
+    fileSize = 0;
+    segmentStart = 0;
+    segmentMoviSize = 4;
+    segmentChunkOffsets.setSize(0);
+    segmentChunkSizes.setSize(0);
+    superIndex.setSize(0);
+    numFrames = 0;
+    maxChunkSize = 0;
+    firstSegmentNumFrames = 0;
+    firstSegmentRIFFSize = 0;
+    firstSegmentMoviSize = 0;
+
+    encoder.reset(new JPEGEncoder());
+    encoder->init(width, height, quality);
+
+    file = fopen(filename, "wb");
+    if (file == nullptr) {
+        printf("ERROR: Unable to open \"%s\" for writing.\n", filename);
+        fflush(stdout);
+        return false;
+    }
+
+    // Write a placeholder header, since the sizes aren't known until finalize.
+    Array<uint8> header;
+    buildHeader(header);
+    assert(header.size() == aviHeaderSize);
+    if (fwrite(header.data(), 1, header.size(), file) != header.size()) {
+        printf("ERROR: Unable to write AVI header to \"%s\".\n", filename);
+        fflush(stdout);
+        close();
+        return false;
+    }
+    fileSize = header.size();
+
+    if (numThreads == 0) {
+        numThreads = std::thread::hardware_concurrency();
+        if (numThreads == 0) {
+            numThreads = 1;
+        }
+    }
+
+    // Limit the number of frames buffered if reading images is faster than encoding them.
+    // Ideally, enough frames are queued that no worker is left idle, but for large
+    // images on machines with many threads, the total size of the buffered images
+    // is limited, and there's no point in having more workers than frames.
+    // At least 2 frames are needed, one being encoded and the most recent one.
+    const uint64 frameBytes = sizeof(uint32)*uint64(width)*height;
+    const uint64 maxFramesForMemory = maxBufferedPixelBytes / frameBytes;
+    maxFramesInUse = 2*numThreads + 1;
+    if (maxFramesInUse > maxFramesForMemory) {
+        maxFramesInUse = (maxFramesForMemory < 2) ? 2 : size_t(maxFramesForMemory);
+    }
+    if (numThreads > maxFramesInUse - 1) {
+        numThreads = maxFramesInUse - 1;
+    }
+
+    stopping = false;
+    workers.reserve(numThreads);
+    for (size_t i = 0; i < numThreads; ++i) {
+        workers.emplace_back(&AVIWriter::workerLoop, this);
+    }
+
+    return true;
+}
+
+void AVIWriter::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        workAvailable.wait(lock, [this]() { return stopping || !encodeQueue.empty(); });
+        if (stopping) {
+            return;
+        }
+        Frame* frame = encodeQueue.front();
+        encodeQueue.pop_front();
+
+        lock.unlock();
+        encoder->encodeFrame(frame->pixels.data(), frame->jpeg);
+        lock.lock();
+
+        frame->encoded = true;
+        frameEncoded.notify_all();
+    }
+}
+
+AVIWriter::Frame* AVIWriter::acquireFrame() {
+    if (freeFrames.size() != 0) {
+        Frame* frame = freeFrames.last();
+        freeFrames.setSize(freeFrames.size() - 1);
+        return frame;
+    }
+    allFrames.emplace_back(new Frame());
+    return allFrames.back().get();
+}
+
+void AVIWriter::releaseFrame(Frame* frame) {
+    assert(frame->numReferences != 0);
+    --frame->numReferences;
+    if (frame->numReferences == 0) {
+        freeFrames.append(frame);
+    }
+}
+
+bool AVIWriter::writeFrame(const uint32* imageData) {
+    if (file == nullptr || failed) {
+        return false;
+    }
+
+    Frame* frame = acquireFrame();
+    const size_t pixelCount = size_t(width)*height;
+    frame->pixels.setSize(pixelCount);
+    memcpy(frame->pixels.data(), imageData, sizeof(uint32)*pixelCount);
+    frame->encoded = false;
+    frame->numReferences = 2;
+
+    if (lastFrame != nullptr) {
+        releaseFrame(lastFrame);
+    }
+    lastFrame = frame;
+    pendingFrames.push_back(frame);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        encodeQueue.push_back(frame);
+    }
+    workAvailable.notify_one();
+
+    return writePendingFrames(false);
+}
+
+bool AVIWriter::repeatFrame(size_t numRepeats) {
+    if (file == nullptr || failed || lastFrame == nullptr) {
+        return false;
+    }
+    for (size_t i = 0; i < numRepeats; ++i) {
+        ++lastFrame->numReferences;
+        pendingFrames.push_back(lastFrame);
+    }
+    return writePendingFrames(false);
+}
+
+bool AVIWriter::writePendingFrames(bool waitForAll) {
+    while (!pendingFrames.empty()) {
+        Frame* frame = pendingFrames.front();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!frame->encoded) {
+                // Only wait if there are too many frames in use,
+                // so that the caller can go back to reading the next image.
+                const size_t numFramesInUse = allFrames.size() - freeFrames.size();
+                if (!waitForAll && numFramesInUse <= maxFramesInUse) {
+                    return true;
+                }
+                frameEncoded.wait(lock, [frame]() { return frame->encoded; });
+            }
+        }
+
+        if (!writeChunk(*frame)) {
+            failed = true;
+            return false;
+        }
+        pendingFrames.pop_front();
+        releaseFrame(frame);
+    }
+    return true;
+}
+
+bool AVIWriter::writeChunk(const Frame& frame) {
+    const size_t dataSize = frame.jpeg.size();
+    const size_t paddedSize = dataSize + (dataSize & 1);
+
+    // Start a new segment if this chunk and its index entries wouldn't fit.
+    // The first segment also has an idx1 entry for each chunk.
+    const bool isFirstSegment = (segmentStart == 0);
+    const size_t numSegmentFrames = segmentChunkSizes.size() + 1;
+    const uint64 segmentHeaderSize = isFirstSegment ? (aviHeaderSize - 4) : (extraSegmentHeaderSize - 4);
+    const uint64 newSegmentSize = segmentHeaderSize + segmentMoviSize + 8 + paddedSize +
+        standardIndexHeaderSize + standardIndexEntrySize*numSegmentFrames +
+        (isFirstSegment ? (8 + legacyIndexEntrySize*numSegmentFrames) : 0);
+    if (newSegmentSize > maxSegmentSize && segmentChunkSizes.size() != 0) {
+        if (!endSegment() || !startSegment()) {
+            return false;
+        }
+    }
+
+    uint8 chunkHeader[8] = {'0','0','d','c',
+        uint8(dataSize), uint8(dataSize >> 8), uint8(dataSize >> 16), uint8(dataSize >> 24)
+    };
+    const uint8 padding = 0;
+    if (fwrite(chunkHeader, 1, 8, file) != 8 ||
+        fwrite(frame.jpeg.data(), 1, dataSize, file) != dataSize ||
+        (paddedSize != dataSize && fwrite(&padding, 1, 1, file) != 1)
+    ) {
+        printf("ERROR: Failed to write frame %u to AVI file.\n", numFrames);
+        fflush(stdout);
+        return false;
+    }
+
+    segmentChunkOffsets.append(uint32(fileSize + 8 - segmentStart));
+    segmentChunkSizes.append(uint32(dataSize));
+    fileSize += 8 + paddedSize;
+    segmentMoviSize += uint32(8 + paddedSize);
+    ++numFrames;
+    if (dataSize > maxChunkSize) {
+        maxChunkSize = uint32(dataSize);
+    }
+    return true;
+}
+
+bool AVIWriter::startSegment() {
+    // The current segment's entry was just added to the super index,
+    // and this segment will need one too.
+    if (superIndex.size() >= maxSuperIndexEntries) {
+        printf("ERROR: AVI file would exceed the maximum of %zu 1GB segments after %u frames.\n", maxSuperIndexEntries, numFrames);
+        fflush(stdout);
+        return false;
+    }
+
+    // The sizes are filled in by endSegment.
+    Array<uint8> header;
+    appendFourCC(header, "RIFF");
+    appendUint32LE(header, 0);
+    appendFourCC(header, "AVIX");
+    appendFourCC(header, "LIST");
+    appendUint32LE(header, 0);
+    appendFourCC(header, "movi");
+    assert(header.size() == extraSegmentHeaderSize);
+    if (fwrite(header.data(), 1, header.size(), file) != header.size()) {
+        printf("ERROR: Failed to write AVI segment header.\n");
+        fflush(stdout);
+        return false;
+    }
+
+    segmentStart = fileSize;
+    fileSize += header.size();
+    segmentMoviSize = 4;
+    return true;
+}
+
+bool AVIWriter::endSegment() {
+    const size_t numSegmentFrames = segmentChunkSizes.size();
+
+    // OpenDML standard index (AVISTDINDEX) for this segment, at the end of its "movi" list.
+    Array<uint8> index;
+    appendFourCC(index, "ix00");
+    appendUint32LE(index, uint32(standardIndexHeaderSize - 8 + standardIndexEntrySize*numSegmentFrames));
+    appendUint16LE(index, 2);               // wLongsPerEntry
+    index.append(0);                        // bIndexSubType
+    index.append(1);                        // bIndexType: AVI_INDEX_OF_CHUNKS
+    appendUint32LE(index, uint32(numSegmentFrames));
+    appendFourCC(index, "00dc");
+    appendUint32LE(index, uint32(segmentStart));         // qwBaseOffset
+    appendUint32LE(index, uint32(segmentStart >> 32));
+    appendUint32LE(index, 0);               // dwReserved
+    for (size_t i = 0; i < numSegmentFrames; ++i) {
+        // The high bit of the size would be set for non-keyframes, but every frame is a keyframe.
+        appendUint32LE(index, segmentChunkOffsets[i]);
+        appendUint32LE(index, segmentChunkSizes[i]);
+    }
+    const uint64 indexOffset = fileSize;
+    const uint32 indexSize = uint32(index.size());
+    segmentMoviSize += indexSize;
+
+    // The first segment also has a plain AVI index, for readers that don't support OpenDML.
+    // idx1 chunk offsets are relative to the "movi" FourCC.
+    const bool isFirstSegment = (segmentStart == 0);
+    if (isFirstSegment) {
+        appendFourCC(index, "idx1");
+        appendUint32LE(index, uint32(legacyIndexEntrySize*numSegmentFrames));
+        for (size_t i = 0; i < numSegmentFrames; ++i) {
+            appendFourCC(index, "00dc");
+            appendUint32LE(index, 0x10);    // AVIIF_KEYFRAME
+            appendUint32LE(index, uint32(segmentChunkOffsets[i] - 8 - moviFourCCOffset));
+            appendUint32LE(index, segmentChunkSizes[i]);
+        }
+    }
+
+    if (fwrite(index.data(), 1, index.size(), file) != index.size()) {
+        printf("ERROR: Failed to write AVI index.\n");
+        fflush(stdout);
+        return false;
+    }
+    fileSize += index.size();
+
+    const uint32 riffSize = uint32(fileSize - segmentStart - 8);
+    if (isFirstSegment) {
+        // The first segment's header is rewritten in finalize.
+        firstSegmentNumFrames = uint32(numSegmentFrames);
+        firstSegmentRIFFSize = riffSize;
+        firstSegmentMoviSize = segmentMoviSize;
+    }
+    else {
+        uint8 riffSizeBytes[4] = {uint8(riffSize), uint8(riffSize >> 8), uint8(riffSize >> 16), uint8(riffSize >> 24)};
+        uint8 moviSizeBytes[4] = {uint8(segmentMoviSize), uint8(segmentMoviSize >> 8), uint8(segmentMoviSize >> 16), uint8(segmentMoviSize >> 24)};
+        const bool success =
+            seekFile(segmentStart + 4) &&
+            fwrite(riffSizeBytes, 1, 4, file) == 4 &&
+            seekFile(segmentStart + 16) &&
+            fwrite(moviSizeBytes, 1, 4, file) == 4 &&
+            seekFile(fileSize);
+        if (!success) {
+            printf("ERROR: Failed to write AVI segment sizes.\n");
+            fflush(stdout);
+            return false;
+        }
+    }
+
+    superIndex.append(SuperIndexEntry{indexOffset, indexSize, uint32(numSegmentFrames)});
+    segmentChunkOffsets.setSize(0);
+    segmentChunkSizes.setSize(0);
+    return true;
+}
+
+bool AVIWriter::seekFile(uint64 offset) {
+    // Segments after the first can be beyond the range of fseek's long offset.
+#ifdef _WIN32
+    return _fseeki64(file, (long long)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+void AVIWriter::buildHeader(Array<uint8>& header) const {
+    const uint32 suggestedBufferSize = (maxChunkSize + 8 + 1) & ~uint32(1);
+    const uint32 microsecondsPerFrame = uint32((uint64(1000000)*fpsDenominator + fpsNumerator/2) / fpsNumerator);
+    const uint32 maxBytesPerSecond = uint32((uint64(suggestedBufferSize)*fpsNumerator + fpsDenominator - 1) / fpsDenominator);
+
+    header.setSize(0);
+
+    appendFourCC(header, "RIFF");
+    appendUint32LE(header, firstSegmentRIFFSize);
+    appendFourCC(header, "AVI ");
+
+    appendFourCC(header, "LIST");
+    appendUint32LE(header, uint32(hdrlListSize));
+    appendFourCC(header, "hdrl");
+
+    // AVIMAINHEADER
+    appendFourCC(header, "avih");
+    appendUint32LE(header, 56);
+    appendUint32LE(header, microsecondsPerFrame);
+    appendUint32LE(header, maxBytesPerSecond);
+    appendUint32LE(header, 0);              // dwPaddingGranularity
+    appendUint32LE(header, 0x10);           // dwFlags: AVIF_HASINDEX
+    appendUint32LE(header, firstSegmentNumFrames); // dwTotalFrames: only the first segment, per OpenDML
+    appendUint32LE(header, 0);              // dwInitialFrames
+    appendUint32LE(header, 1);              // dwStreams
+    appendUint32LE(header, suggestedBufferSize);
+    appendUint32LE(header, width);
+    appendUint32LE(header, height);
+    for (size_t i = 0; i < 4; ++i) {
+        appendUint32LE(header, 0);          // dwReserved
+    }
+
+    appendFourCC(header, "LIST");
+    appendUint32LE(header, uint32(strlListSize));
+    appendFourCC(header, "strl");
+
+    // AVISTREAMHEADER
+    appendFourCC(header, "strh");
+    appendUint32LE(header, 56);
+    appendFourCC(header, "vids");
+    appendFourCC(header, "MJPG");
+    appendUint32LE(header, 0);              // dwFlags
+    appendUint16LE(header, 0);              // wPriority
+    appendUint16LE(header, 0);              // wLanguage
+    appendUint32LE(header, 0);              // dwInitialFrames
+    appendUint32LE(header, fpsDenominator); // dwScale
+    appendUint32LE(header, fpsNumerator);   // dwRate
+    appendUint32LE(header, 0);              // dwStart
+    appendUint32LE(header, numFrames);      // dwLength
+    appendUint32LE(header, suggestedBufferSize);
+    appendUint32LE(header, 0xFFFFFFFF);     // dwQuality: default
+    appendUint32LE(header, 0);              // dwSampleSize: varies
+    appendUint16LE(header, 0);              // rcFrame
+    appendUint16LE(header, 0);
+    appendUint16LE(header, width);
+    appendUint16LE(header, height);
+
+    // BITMAPINFOHEADER
+    appendFourCC(header, "strf");
+    appendUint32LE(header, 40);
+    appendUint32LE(header, 40);             // biSize
+    appendUint32LE(header, width);
+    appendUint32LE(header, height);
+    appendUint16LE(header, 1);              // biPlanes
+    appendUint16LE(header, 24);             // biBitCount
+    appendFourCC(header, "MJPG");           // biCompression
+    appendUint32LE(header, width*height*3); // biSizeImage
+    appendUint32LE(header, 0);              // biXPelsPerMeter
+    appendUint32LE(header, 0);              // biYPelsPerMeter
+    appendUint32LE(header, 0);              // biClrUsed
+    appendUint32LE(header, 0);              // biClrImportant
+
+    // OpenDML super index (AVISUPERINDEX), with space reserved for all entries.
+    appendFourCC(header, "indx");
+    appendUint32LE(header, uint32(24 + 16*maxSuperIndexEntries));
+    appendUint16LE(header, 4);              // wLongsPerEntry
+    header.append(0);                       // bIndexSubType
+    header.append(0);                       // bIndexType: AVI_INDEX_OF_INDEXES
+    appendUint32LE(header, uint32(superIndex.size()));
+    appendFourCC(header, "00dc");
+    for (size_t i = 0; i < 3; ++i) {
+        appendUint32LE(header, 0);          // dwReserved
+    }
+    for (size_t i = 0; i < maxSuperIndexEntries; ++i) {
+        const SuperIndexEntry entry = (i < superIndex.size()) ? superIndex[i] : SuperIndexEntry{0, 0, 0};
+        appendUint32LE(header, uint32(entry.offset));
+        appendUint32LE(header, uint32(entry.offset >> 32));
+        appendUint32LE(header, entry.size);
+        appendUint32LE(header, entry.numFrames);
+    }
+
+    // OpenDML extended header, with the total number of frames in all segments.
+    appendFourCC(header, "LIST");
+    appendUint32LE(header, uint32(odmlListSize));
+    appendFourCC(header, "odml");
+    appendFourCC(header, "dmlh");
+    appendUint32LE(header, 248);
+    appendUint32LE(header, numFrames);      // dwTotalFrames
+    for (size_t i = 0; i < 244; ++i) {
+        header.append(0);
+    }
+
+    appendFourCC(header, "LIST");
+    appendUint32LE(header, firstSegmentMoviSize);
+    appendFourCC(header, "movi");
+}
+
+bool AVIWriter::finalize() {
+    if (file == nullptr) {
+        return false;
+    }
+    if (failed || !writePendingFrames(true) || !endSegment()) {
+        close();
+        return false;
+    }
+
+    Array<uint8> header;
+    buildHeader(header);
+    assert(header.size() == aviHeaderSize);
+
+    const bool success =
+        seekFile(0) &&
+        fwrite(header.data(), 1, header.size(), file) == header.size();
+    if (!success) {
+        printf("ERROR: Failed to write AVI header.\n");
+        fflush(stdout);
+    }
+
+    close();
+    return success;
+}
+
+void AVIWriter::close() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        encodeQueue.clear();
+    }
+    workAvailable.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    pendingFrames.clear();
+    lastFrame = nullptr;
+    freeFrames.setSize(0);
+    allFrames.clear();
+
+    if (file != nullptr) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+} // namespace mjpeg
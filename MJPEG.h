@@ -0,0 +1,161 @@
+#pragma once
+
+#include <Array.h>
+#include <Types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+namespace mjpeg {
+
+using namespace OUTER_NAMESPACE;
+using namespace OUTER_NAMESPACE :: COMMON_LIBRARY_NAMESPACE;
+
+struct JPEGEncoder;
+
+// Writes an AVI file containing a single MJPEG video stream.
+// The file is split into RIFF segments of at most 1GB, with OpenDML indices,
+// so that the output isn't limited to the 32-bit sizes of plain AVI.
+// Readers that don't support OpenDML will only see the first segment.
+// Every frame is encoded independently as a baseline JPEG image,
+// so frames are encoded in parallel on a pool of worker threads,
+// and the results are written to the file in the order they were submitted.
+//
+// Input images are 32-bit RGB (blue in the low byte), with the bottom row first,
+// the same layout as is passed to Media Foundation as MFVideoFormat_RGB32.
+class AVIWriter {
+public:
+    AVIWriter();
+    ~AVIWriter();
+
+    AVIWriter(const AVIWriter&) = delete;
+    AVIWriter& operator=(const AVIWriter&) = delete;
+
+    // quality is in the range [1,100], the same as the usual JPEG quality scale.
+    // If numThreads is zero, one worker thread is used per hardware thread.
+    // Fewer threads may be used for large images, to limit the memory used by buffered frames.
+    bool open(
+        const char* filename,
+        uint32 width,
+        uint32 height,
+        uint32 fpsNumerator,
+        uint32 fpsDenominator,
+        uint32 quality,
+        size_t numThreads = 0
+    );
+
+    bool isOpen() const noexcept {
+        return file != nullptr;
+    }
+
+    // Copies the image, so the caller can reuse imageData as soon as this returns.
+    bool writeFrame(const uint32* imageData);
+
+    // Writes the most recent frame numRepeats more times, without re-encoding it.
+    bool repeatFrame(size_t numRepeats);
+
+    // Waits for all frames to be encoded, then writes the index
+    // and the final header, and closes the file.
+    bool finalize();
+
+    // Stops the worker threads and closes the file without finalizing it.
+    void close() noexcept;
+
+private:
+    struct Frame {
+        Array<uint32> pixels;
+        Array<uint8> jpeg;
+        bool encoded = false;
+
+        // Number of entries in pendingFrames referring to this frame,
+        // plus one if it is lastFrame.  Only accessed by the calling thread.
+        size_t numReferences = 0;
+    };
+
+    void workerLoop();
+    Frame* acquireFrame();
+    void releaseFrame(Frame* frame);
+    bool writePendingFrames(bool waitForAll);
+    bool writeChunk(const Frame& frame);
+    bool startSegment();
+    bool endSegment();
+    bool seekFile(uint64 offset);
+    void buildHeader(Array<uint8>& header) const;
+
+    FILE* file = nullptr;
+    uint32 width = 0;
+    uint32 height = 0;
+    uint32 fpsNumerator = 30;
+    uint32 fpsDenominator = 1;
+    bool failed = false;
+
+    std::unique_ptr<JPEGEncoder> encoder;
+
+    // All frames ever allocated, and the ones not currently in use.
+    std::vector<std::unique_ptr<Frame>> allFrames;
+    Array<Frame*> freeFrames;
+    size_t maxFramesInUse = 0;
+
+    // Most recently submitted frame, kept for repeatFrame.
+    Frame* lastFrame = nullptr;
+
+    // Frames waiting to be written to the file, in order.
+    // A repeated frame appears multiple times.
+    std::deque<Frame*> pendingFrames;
+
+    // Frames waiting to be encoded, shared with the worker threads.
+    std::deque<Frame*> encodeQueue;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable frameEncoded;
+    std::vector<std::thread> workers;
+
+    // Entry of the OpenDML super index, referring to the "ix00" index chunk of one RIFF segment.
+    struct SuperIndexEntry {
+        uint64 offset;
+        uint32 size;
+        uint32 numFrames;
+    };
+
+    // Current end of the file, and start of the current RIFF segment.
+    uint64 fileSize = 0;
+    uint64 segmentStart = 0;
+
+    // Size of the current segment's "movi" list, including the "movi" FourCC.
+    uint32 segmentMoviSize = 0;
+
+    // Offset of each chunk's data relative to segmentStart, and its size
+    // excluding the chunk header and padding, for the current segment.
+    Array<uint32> segmentChunkOffsets;
+    Array<uint32> segmentChunkSizes;
+
+    Array<SuperIndexEntry> superIndex;
+
+    uint32 numFrames = 0;
+    uint32 maxChunkSize = 0;
+
+    // Sizes for the first segment's header, which is only rewritten in finalize.
+    uint32 firstSegmentNumFrames = 0;
+    uint32 firstSegmentRIFFSize = 0;
+    uint32 firstSegmentMoviSize = 0;
+};
+
+// Media Foundation's encoders take a target bit rate, whereas JPEG takes a quality,
+// so this estimates a quality that will produce roughly the requested bit rate
+// for typical content.  There is no rate control, so the actual bit rate can differ.
+uint32 qualityFromBitRate(
+    uint32 bitsPerSecond,
+    uint32 width,
+    uint32 height,
+    uint32 fpsNumerator,
+    uint32 fpsDenominator
+);
+
+} // namespace mjpeg
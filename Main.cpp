@@ -7,27 +7,37 @@
 #include <File.h>
 #include <Types.h>
 
+#include "MJPEG.h"
+
+#ifdef _WIN32
 #include <Windows.h>
 #include <mfapi.h>
 #include <mfidl.h>
 #include <mfreadwrite.h>
 #include <mferror.h>
 #undef DeleteFile
+#include <comdef.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <assert.h>
-#include <comdef.h>
 #include <memory>
 #include <stdint.h>
 #include <stdio.h>
 #include <utility>
 
+#ifdef _WIN32
 #pragma comment(lib, "mfreadwrite")
 #pragma comment(lib, "mfplat")
 #pragma comment(lib, "mfuuid")
+#endif
 
 using namespace OUTER_NAMESPACE;
 using namespace OUTER_NAMESPACE :: COMMON_LIBRARY_NAMESPACE;
 
+#ifdef _WIN32
+
 bool hresultSuccess(HRESULT h) {
     if (SUCCEEDED(h)) {
         return true;
@@ -88,6 +98,7 @@ struct ReleasePtr {
         return p;
     }
 };
+#endif
 
 struct FormatInfo {
     uint32 width;
@@ -95,13 +106,24 @@ struct FormatInfo {
     uint32 fpsNumerator = 30;
     uint32 fpsDenominator = 1;
     uint32 averageBitsPerSecond = 4500000; // 4500kbps default
+    // MJPEG quality in [1,100], or 0 to derive it from the bit rate if specified.
+    uint32 jpegQuality = 0;
+    bool isBitRateSpecified = false;
+    bool isMJPEGOutput = false;
+#ifdef _WIN32
     GUID imageFormat = MFVideoFormat_RGB32;
     GUID videoFormat = MFVideoFormat_H264;
+#endif
 };
 
 // 100ns units, so 10 million of them per second
 constexpr static uint64 timeUnitsPerSecond = 10000000;
 
+// Used for MJPEG output if neither "quality" nor "bitrate" is specified.
+constexpr static uint32 defaultJPEGQuality = 85;
+
+#ifdef _WIN32
+
 static std::pair<ReleasePtr<IMFSinkWriter>, DWORD> createWriter(const char* filename, const FormatInfo& format)
 {
     std::pair<ReleasePtr<IMFSinkWriter>, DWORD> retVal{ReleasePtr<IMFSinkWriter>(),0};
@@ -251,6 +273,21 @@ struct MFShutdowner {
         MFShutdown();
     }
 };
+#endif
+
+static bool createMJPEGWriter(mjpeg::AVIWriter& writer, const char* filename, const FormatInfo& format)
+{
+    uint32 quality = format.jpegQuality;
+    if (quality == 0) {
+        if (format.isBitRateSpecified) {
+            quality = mjpeg::qualityFromBitRate(format.averageBitsPerSecond, format.width, format.height, format.fpsNumerator, format.fpsDenominator);
+        }
+        else {
+            quality = defaultJPEGQuality;
+        }
+    }
+    return writer.open(filename, format.width, format.height, format.fpsNumerator, format.fpsDenominator, quality);
+}
 
 // NOTE: The filename will not be zero-terminated!
 bool getNextFilename(Array<char>& filename) {
@@ -313,6 +350,9 @@ bool getNextFilename(Array<char>& filename) {
 // VideoIO.exe outputVideo.mp4 < imageFilenames.txt
 // If the output filename extension is .wmv, it will be encoded using the WMV3 codec,
 // instead of the H.264 codec.
+// If the output filename extension is .avi, it will be encoded as MJPEG by the built-in
+// encoder, using all CPU cores, instead of by Media Foundation.  This is the only
+// output format supported on platforms other than Windows.
 //
 // Special "filenames":
 // - "stop", "quit", "done", "exit", or "end": Processing will be stopped.
@@ -322,13 +362,18 @@ bool getNextFilename(Array<char>& filename) {
 // - "resolution <number>x<number>": Sets the resolution, if no images have been encountered yet.
 // - "fps <number>" or "fps <number>/<number>": Sets the frames per second, possibly as a fraction, if no images have been encountered yet.
 // - "bitrate <number>": Sets the target average bits per second, if no images have been encountered yet.
+//   For MJPEG output, this is only used to estimate a quality, if "quality" isn't specified.
+// - "quality <number>": Sets the MJPEG quality from 1 to 100, if no images have been encountered yet.
 // - "output <filename>": Specifies the output filename.
+// - "pipe <number>": Reads one image of the current resolution from a pipe.  On Windows, the number is
+//   the pipe's read HANDLE in hexadecimal.  On other platforms, it is a file descriptor in decimal.
 // - "image <filename>": In case a filename might need to match one of the commands above, this gives a way to be explicit about the filename.
 // - Any lines starting with # will be skipped, for easy commenting-out of files.
 //
 // NOTE: H.264 codec does not support odd width or height!
 int main(int argc, char** argv)
 {
+#ifdef _WIN32
     if (!hresultSuccess(CoInitializeEx(NULL,COINIT_APARTMENTTHREADED))) {
         printf("ERROR: Failed to initialize COM.  Exiting.\n");
         fflush(stdout);
@@ -342,6 +387,7 @@ int main(int argc, char** argv)
         return -1;
     }
     MFShutdowner mfshutdown;
+#endif
 
     Array<uint32> imageData;
 
@@ -349,10 +395,15 @@ int main(int argc, char** argv)
 
     FormatInfo format{0,0};
 
+#ifdef _WIN32
     std::pair<ReleasePtr<IMFSinkWriter>, DWORD> writerAndStreamIndex;
+#endif
+    mjpeg::AVIWriter mjpegWriter;
 
-    // Current frame start time in 100ns units.
+#ifdef _WIN32
+    // Current frame start time in 100ns units, for Media Foundation.
     uint64 frameStartTime = 0;
+#endif
 
     Array<char> previousFilename;
     Array<char> inputFilename;
@@ -397,6 +448,15 @@ int main(int argc, char** argv)
             size_t numRepeats;
             size_t charactersUsed = text::textToInteger(numberText, numberTextEnd, numRepeats);
             if (charactersUsed == numberTextEnd-numberText && imageData.size() != 0) {
+                if (mjpegWriter.isOpen()) {
+                    // The previous frame's encoded data can be reused, instead of encoding it again.
+                    if (numRepeats > 1 && !mjpegWriter.repeatFrame(numRepeats - 1)) {
+                        return -1;
+                    }
+                    framei += (numRepeats > 1) ? (numRepeats - 1) : 0;
+                    continue;
+                }
+#ifdef _WIN32
                 // NOTE: The image was already included once, so skip the first one here.
                 for (size_t repeat = 1; repeat < numRepeats; ++repeat) {
                     uint64_t frameEndTime = (timeUnitsPerSecond * framei * format.fpsDenominator) / format.fpsNumerator;
@@ -406,6 +466,7 @@ int main(int argc, char** argv)
                     ++framei;
                     frameStartTime = frameEndTime;
                 }
+#endif
             }
             else {
                 printf("WARNING: Invalid \"repeat <number>\" command: either no previous file to repeat or invalid number of repeats.\n");
@@ -444,6 +505,7 @@ int main(int argc, char** argv)
             size_t charactersUsed = text::textToInteger(numberText, numberTextEnd, bitRate);
             if (charactersUsed == numberTextEnd-numberText && framei == 0 && bitRate != 0) {
                 format.averageBitsPerSecond = bitRate;
+                format.isBitRateSpecified = true;
             }
             else {
                 printf("WARNING: Invalid \"bitrate <number>\" command: either invalid integer, or video already started.\n");
@@ -452,6 +514,22 @@ int main(int argc, char** argv)
             continue;
         }
 
+        // "quality <number>" command
+        if (inputFilename.size() > 8 && text::areEqualSizeStringsEqual(inputFilename.data(),"quality ",8)) {
+            const char* numberText = inputFilename.data() + 8;
+            const char* numberTextEnd = inputFilename.end();
+            uint32 quality;
+            size_t charactersUsed = text::textToInteger(numberText, numberTextEnd, quality);
+            if (charactersUsed == numberTextEnd-numberText && framei == 0 && quality >= 1 && quality <= 100) {
+                format.jpegQuality = quality;
+            }
+            else {
+                printf("WARNING: Invalid \"quality <number>\" command: either invalid integer from 1 to 100, or video already started.\n");
+                fflush(stdout);
+            }
+            continue;
+        }
+
         // "resolution <number>x<number>" command
         if (inputFilename.size() > 11 && text::areEqualSizeStringsEqual(inputFilename.data(),"resolution ",11)) {
             const char* numberText = inputFilename.data() + 11;
@@ -463,11 +541,6 @@ int main(int argc, char** argv)
                 numberText += charactersUsed+1;
                 charactersUsed = text::textToInteger(numberText, numberTextEnd, height);
             }
-            if ((width & 1) || (height & 1)) {
-                printf("ERROR: H.264 codec does not support odd width or height.  Exiting.\n");
-                fflush(stdout);
-                return -1;
-            }
             if (charactersUsed == numberTextEnd-numberText && framei == 0 && width != 0 && height != 0) {
                 format.width = width;
                 format.height = height;
@@ -493,7 +566,13 @@ int main(int argc, char** argv)
             ) {
                 isWMVOutput = true;
             }
+            format.isMJPEGOutput = (outputFilename.size() >= 6 &&
+                text::areEqualSizeStringsEqual(outputFilename.end()-5,".avi",4));
+#ifdef _WIN32
             format.videoFormat = isWMVOutput ? MFVideoFormat_WMV3 : MFVideoFormat_H264;
+#else
+            (void)isWMVOutput;
+#endif
             continue;
         }
 
@@ -527,6 +606,7 @@ int main(int argc, char** argv)
         }
 
         if (commandStartedWithPipe) {
+#ifdef _WIN32
             uintptr_t pipeReadHandleNumber;
             size_t numCharactersUsed = text::textToInteger<16>(inputFilename.data() + 5, inputFilename.end(), pipeReadHandleNumber);
             if (numCharactersUsed != inputFilename.size()-5) {
@@ -545,6 +625,32 @@ int main(int argc, char** argv)
                 fflush(stdout);
                 return -1;
             }
+#else
+            // On other platforms, the number is a decimal file descriptor,
+            // instead of a hexadecimal HANDLE value.
+            int pipeFileDescriptor;
+            size_t numCharactersUsed = text::textToInteger(inputFilename.data() + 5, inputFilename.end(), pipeFileDescriptor);
+            if (numCharactersUsed != inputFilename.size()-5) {
+                printf("ERROR: Invalid pipe \"%s\" specified.  Exiting.\n", inputFilename.data()+5);
+                fflush(stdout);
+                return -1;
+            }
+
+            imageData.setSize(pixelCount);
+            // Reads from pipes can return less than requested, so keep reading until the image is complete.
+            char* destination = (char*)imageData.data();
+            size_t numBytesRemaining = sizeof(uint32)*pixelCount;
+            while (numBytesRemaining != 0) {
+                ssize_t numBytesRead = ::read(pipeFileDescriptor, destination, numBytesRemaining);
+                if (numBytesRead <= 0) {
+                    printf("ERROR: Unable to read pipe \"%s\".  Exiting.\n", inputFilename.data()+5);
+                    fflush(stdout);
+                    return -1;
+                }
+                destination += numBytesRead;
+                numBytesRemaining -= size_t(numBytesRead);
+            }
+#endif
 
             inputFilename.setSize(0);
             previousFilename.setSize(0);
@@ -575,11 +681,6 @@ int main(int argc, char** argv)
                     else {
                         format.width = uint32(bmpWidth);
                         format.height = uint32(bmpHeight);
-                        if ((format.width & 1) || (format.height & 1)) {
-                            printf("ERROR: H.264 codec does not support odd width or height.  Exiting.\n");
-                            fflush(stdout);
-                            return -1;
-                        }
 
                         pixelCount = size_t(format.width)*format.height;
                         if (pixelCount == 0) {
@@ -621,16 +722,52 @@ int main(int argc, char** argv)
                 return -1;
             }
 
-            writerAndStreamIndex = createWriter(outputFilename.data(), format);
-            if (writerAndStreamIndex.first.p == nullptr) {
+            bool success;
+            if (format.isMJPEGOutput) {
+                success = createMJPEGWriter(mjpegWriter, outputFilename.data(), format);
+            }
+            else {
+#ifdef _WIN32
+                // MJPEG supports odd sizes, but H.264 doesn't.
+                if ((format.width & 1) || (format.height & 1)) {
+                    printf("ERROR: H.264 codec does not support odd width or height.  Exiting.\n");
+                    fflush(stdout);
+                    return -1;
+                }
+
+                writerAndStreamIndex = createWriter(outputFilename.data(), format);
+                success = (writerAndStreamIndex.first.p != nullptr);
+#else
+                printf("ERROR: Only .avi (MJPEG) output is supported on this platform.  Exiting.\n");
+                fflush(stdout);
+                return -1;
+#endif
+            }
+            if (!success) {
                 printf("ERROR: Unable to create video writer for \"%s\" with %ux%u resolution.  Exiting.\n", outputFilename.data(), format.width, format.height);
                 fflush(stdout);
                 return -1;
             }
         }
 
+#ifdef _WIN32
         uint64_t frameEndTime = (timeUnitsPerSecond * framei * format.fpsDenominator) / format.fpsNumerator;
-        if (!writeFrame(writerAndStreamIndex.first.p, writerAndStreamIndex.second, imageData.data(), frameStartTime, frameEndTime, format)) {
+#endif
+        // NOTE: This checks which writer was created, not the current output filename,
+        // because "output" can still be changed after the first frame, to change which
+        // file is finalized or deleted, but the encoder can't be switched at that point.
+        bool success;
+        if (mjpegWriter.isOpen()) {
+            success = mjpegWriter.writeFrame(imageData.data());
+        }
+        else {
+#ifdef _WIN32
+            success = writeFrame(writerAndStreamIndex.first.p, writerAndStreamIndex.second, imageData.data(), frameStartTime, frameEndTime, format);
+#else
+            success = false;
+#endif
+        }
+        if (!success) {
             printf("ERROR: Failed to write frame %zu of \"%s\".  Exiting.\n", framei, outputFilename.data());
             fflush(stdout);
             return -1;
@@ -640,10 +777,25 @@ int main(int argc, char** argv)
         }
 
         ++framei;
+#ifdef _WIN32
         frameStartTime = frameEndTime;
+#endif
         previousFilename = std::move(inputFilename);
     }
 
+    if (mjpegWriter.isOpen()) {
+        if (!mjpegWriter.finalize()) {
+            printf("ERROR: Failed to finalize \"%s\".  Exiting.\n", outputFilename.data());
+            fflush(stdout);
+            return -1;
+        }
+
+        if (cancelled) {
+            DeleteFile(outputFilename.data());
+        }
+    }
+
+#ifdef _WIN32
     if (writerAndStreamIndex.first.p != nullptr) {
         if (!hresultSuccess(writerAndStreamIndex.first->Finalize())) {
             printf("ERROR: Failed to finalize \"%s\".  Exiting.\n", outputFilename.data());
@@ -655,6 +807,7 @@ int main(int argc, char** argv)
             DeleteFile(outputFilename.data());
         }
     }
+#endif
 
     return 0;
 }